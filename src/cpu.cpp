@@ -0,0 +1,758 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "cpu.hpp"
+#include "png.hpp"
+
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// 32 bit x86 stays scalar, the kernels use 64 bit only intrinsics
+#if defined(__x86_64__) || defined(_M_X64)
+#define CPU_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__aarch64__) && !defined(_MSC_VER)
+#define CPU_ARM 1
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+// msvc allows any intrinsic anywhere, gcc and clang need each function marked
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static_assert(sizeof(Pixel) == 8, "Pixel is four 16 bit samples");
+
+// scalar reference kernels
+
+static constexpr std::array<uint32_t, 256> makeCrcTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i <= 0xFF; i++) {
+        uint32_t crc = i;
+        for (uint32_t j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((0 - (crc & 1)) & 0xEDB88320L);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc_table = makeCrcTable();
+
+static uint32_t crc32Scalar(const uint8_t* data, size_t size, uint32_t crc) {
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+// largest prime smaller than 65536
+constexpr const uint32_t ADLER_BASE = 65521U;
+
+// NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1
+constexpr const size_t NMAX = 5552;
+
+static uint32_t adler32Scalar(const uint8_t* data, size_t size, uint32_t adler) {
+    uint32_t sum1 = adler & 0xffff;
+    uint32_t sum2 = (adler >> 16) & 0xffff;
+
+    while (size > 0) {
+        size_t count = std::min(size, NMAX);
+        size -= count;
+
+        for (size_t i = 0; i < count; i++) {
+            sum1 += data[i]; sum2 += sum1;
+        }
+        data += count;
+
+        sum1 %= ADLER_BASE;
+        sum2 %= ADLER_BASE;
+    }
+
+    return sum1 | (sum2 << 16);
+}
+
+static void packRowScalar(const Pixel* pixels, size_t count, bool alpha, bool eight_bit, uint8_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        auto& pixel = pixels[i];
+        if (eight_bit) {
+            *out++ = pixel.r >> 8;
+            *out++ = pixel.g >> 8;
+            *out++ = pixel.b >> 8;
+            if (alpha) {
+                *out++ = pixel.a >> 8;
+            }
+        } else {
+            *out++ = pixel.r >> 8;
+            *out++ = pixel.r & 0xff;
+            *out++ = pixel.g >> 8;
+            *out++ = pixel.g & 0xff;
+            *out++ = pixel.b >> 8;
+            *out++ = pixel.b & 0xff;
+            if (alpha) {
+                *out++ = pixel.a >> 8;
+                *out++ = pixel.a & 0xff;
+            }
+        }
+    }
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// filters bytes start to end of a row
+static void filterBytesScalar(uint8_t type, const uint8_t* line, const uint8_t* prev, size_t start, size_t end, size_t bpp, uint8_t* out) {
+    for (size_t i = start; i < end; i++) {
+        uint8_t a = i >= bpp ? line[i - bpp] : 0;
+        uint8_t b = prev ? prev[i] : 0;
+        uint8_t c = prev && i >= bpp ? prev[i - bpp] : 0;
+
+        switch (type) {
+        case 0: out[i] = line[i]; break;
+        case 1: out[i] = line[i] - a; break;
+        case 2: out[i] = line[i] - b; break;
+        case 3: out[i] = line[i] - ((a + b) >> 1); break;
+        default: out[i] = line[i] - paeth(a, b, c); break;
+        }
+    }
+}
+
+static uint64_t filterCostScalar(const uint8_t* out, size_t size) {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < size; i++) {
+        cost += std::abs(static_cast<int8_t>(out[i]));
+    }
+    return cost;
+}
+
+static uint64_t filterRowScalar(uint8_t type, const uint8_t* line, const uint8_t* prev, size_t size, size_t bpp, uint8_t* out) {
+    filterBytesScalar(type, line, prev, 0, size, bpp, out);
+    return filterCostScalar(out, size);
+}
+
+static uint32_t matchLengthScalar(const uint8_t* a, const uint8_t* b, uint32_t max) {
+    uint32_t length = 0;
+    while (length < max && a[length] == b[length]) {
+        length++;
+    }
+    return length;
+}
+
+#if CPU_X86
+
+static uint32_t countTrailingZeros(uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+TARGET("sse4.2")
+static __m128i load128(const uint8_t* data) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+
+// x * k, folded 128 bits forward onto next
+TARGET("sse4.2,pclmul")
+static __m128i fold128(__m128i x, __m128i k, __m128i next) {
+    __m128i low = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i high = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// carry-less multiplication folding, see "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction", Intel 2009, and chromium's zlib
+TARGET("sse4.2,pclmul")
+static uint32_t crc32Pclmul(const uint8_t* data, size_t size, uint32_t crc) {
+    if (size < 64) return crc32Scalar(data, size, crc);
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_xor_si128(load128(data), _mm_cvtsi32_si128(crc));
+    __m128i x2 = load128(data + 16);
+    __m128i x3 = load128(data + 32);
+    __m128i x4 = load128(data + 48);
+    data += 64;
+    size -= 64;
+
+    // four 128 bit lanes at a time
+    while (size >= 64) {
+        x1 = fold128(x1, k1k2, load128(data));
+        x2 = fold128(x2, k1k2, load128(data + 16));
+        x3 = fold128(x3, k1k2, load128(data + 32));
+        x4 = fold128(x4, k1k2, load128(data + 48));
+        data += 64;
+        size -= 64;
+    }
+
+    // fold into one lane, then 16 bytes at a time
+    x1 = fold128(x1, k3k4, x2);
+    x1 = fold128(x1, k3k4, x3);
+    x1 = fold128(x1, k3k4, x4);
+    while (size >= 16) {
+        x1 = fold128(x1, k3k4, load128(data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return crc32Scalar(data, size, _mm_extract_epi32(x1, 1));
+}
+
+// per block of n bytes: sum1 += sum(bytes), sum2 += n * sum1 + sum((n - i) * bytes[i])
+TARGET("sse4.2,ssse3")
+static uint32_t adler32Ssse3(const uint8_t* data, size_t size, uint32_t adler) {
+    constexpr const size_t BLOCK = 16;
+
+    uint64_t sum1 = adler & 0xffff;
+    uint64_t sum2 = (adler >> 16) & 0xffff;
+
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (size >= BLOCK) {
+        size_t blocks = std::min(size, NMAX) / BLOCK;
+        size -= blocks * BLOCK;
+        sum2 += sum1 * BLOCK * blocks;
+
+        __m128i v_sum1 = zero;
+        __m128i v_prefix = zero;
+        __m128i v_sum2 = zero;
+        for (size_t i = 0; i < blocks; i++) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            v_prefix = _mm_add_epi32(v_prefix, v_sum1);
+            v_sum1 = _mm_add_epi32(v_sum1, _mm_sad_epu8(bytes, zero));
+            v_sum2 = _mm_add_epi32(v_sum2, _mm_madd_epi16(_mm_maddubs_epi16(bytes, weights), ones));
+            data += BLOCK;
+        }
+        v_sum2 = _mm_add_epi32(v_sum2, _mm_slli_epi32(v_prefix, 4));
+
+        uint32_t lanes1[4];
+        uint32_t lanes2[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes1), v_sum1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes2), v_sum2);
+        for (int i = 0; i < 4; i++) {
+            sum1 += lanes1[i];
+            sum2 += lanes2[i];
+        }
+
+        sum1 %= ADLER_BASE;
+        sum2 %= ADLER_BASE;
+    }
+
+    return adler32Scalar(data, size, static_cast<uint32_t>(sum1 | (sum2 << 16)));
+}
+
+TARGET("avx2")
+static uint32_t adler32Avx2(const uint8_t* data, size_t size, uint32_t adler) {
+    constexpr const size_t BLOCK = 32;
+
+    uint64_t sum1 = adler & 0xffff;
+    uint64_t sum2 = (adler >> 16) & 0xffff;
+
+    const __m256i weights = _mm256_setr_epi8(
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (size >= BLOCK) {
+        size_t blocks = std::min(size, NMAX) / BLOCK;
+        size -= blocks * BLOCK;
+        sum2 += sum1 * BLOCK * blocks;
+
+        __m256i v_sum1 = zero;
+        __m256i v_prefix = zero;
+        __m256i v_sum2 = zero;
+        for (size_t i = 0; i < blocks; i++) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+            v_prefix = _mm256_add_epi32(v_prefix, v_sum1);
+            v_sum1 = _mm256_add_epi32(v_sum1, _mm256_sad_epu8(bytes, zero));
+            v_sum2 = _mm256_add_epi32(v_sum2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+            data += BLOCK;
+        }
+        v_sum2 = _mm256_add_epi32(v_sum2, _mm256_slli_epi32(v_prefix, 5));
+
+        uint32_t lanes1[8];
+        uint32_t lanes2[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes1), v_sum1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes2), v_sum2);
+        for (int i = 0; i < 8; i++) {
+            sum1 += lanes1[i];
+            sum2 += lanes2[i];
+        }
+
+        sum1 %= ADLER_BASE;
+        sum2 %= ADLER_BASE;
+    }
+
+    return adler32Scalar(data, size, static_cast<uint32_t>(sum1 | (sum2 << 16)));
+}
+
+// byte swaps two pixels per shuffle, dropping alpha and low bytes as needed
+// stores are 16 bytes wide, so the last few pixels are left to the scalar loop
+TARGET("sse4.2,ssse3")
+static void packRowSsse3(const Pixel* pixels, size_t count, bool alpha, bool eight_bit, uint8_t* out) {
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(pixels);
+    size_t size = (alpha ? 4 : 3) * (eight_bit ? 1 : 2);
+
+    __m128i shuffle;
+    if (!eight_bit && alpha) {
+        shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    } else if (!eight_bit) {
+        shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 9, 8, 11, 10, 13, 12, -1, -1, -1, -1);
+    } else if (alpha) {
+        shuffle = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    } else {
+        shuffle = _mm_setr_epi8(1, 3, 5, 9, 11, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    }
+
+    size_t i = 0;
+    for (; i + 2 <= count && (count - i) * size >= 16; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * size), _mm_shuffle_epi8(v, shuffle));
+    }
+
+    packRowScalar(pixels + i, count - i, alpha, eight_bit, out + i * size);
+}
+
+// four pixels per shuffle for 16 bit samples, 8 bit rows use the sse version
+TARGET("avx2")
+static void packRowAvx2(const Pixel* pixels, size_t count, bool alpha, bool eight_bit, uint8_t* out) {
+    if (eight_bit) {
+        packRowSsse3(pixels, count, alpha, eight_bit, out);
+        return;
+    }
+
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(pixels);
+    size_t size = alpha ? 8 : 6;
+
+    // shuffles stay within 128 bit lanes, without alpha each lane holds
+    // 12 bytes that are then moved together
+    const __m256i shuffle = alpha
+        ? _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+        : _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 9, 8, 11, 10, 13, 12, -1, -1, -1, -1,
+            1, 0, 3, 2, 5, 4, 9, 8, 11, 10, 13, 12, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    size_t i = 0;
+    for (; i + 4 <= count && (count - i) * size >= 32; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i * 8));
+        v = _mm256_shuffle_epi8(v, shuffle);
+        if (!alpha) {
+            v = _mm256_permutevar8x32_epi32(v, compact);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * size), v);
+    }
+
+    packRowSsse3(pixels + i, count - i, alpha, eight_bit, out + i * size);
+}
+
+// paeth predictor on 16 bit lanes, pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+TARGET("sse4.2,ssse3")
+static __m128i paeth16(__m128i a, __m128i b, __m128i c) {
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i pa = _mm_abs_epi16(bc);
+    __m128i pb = _mm_abs_epi16(ac);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(bc, ac));
+
+    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+    return _mm_blendv_epi8(a, _mm_blendv_epi8(b, c, not_b), not_a);
+}
+
+TARGET("sse4.2,ssse3")
+static __m128i paeth8(__m128i a, __m128i b, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i low = paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i high = paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_packus_epi16(low, high);
+}
+
+// 16 bytes per step after the first pixel, which has no left neighbour
+TARGET("sse4.2,ssse3")
+static uint64_t filterRowSse41(uint8_t type, const uint8_t* line, const uint8_t* prev, size_t size, size_t bpp, uint8_t* out) {
+    // the first row of an image, rare enough to leave to the scalar version
+    if (!prev && type >= 2) {
+        return filterRowScalar(type, line, prev, size, bpp, out);
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low_bit = _mm_set1_epi8(1);
+
+    size_t i = std::min(bpp, size);
+    filterBytesScalar(type, line, prev, 0, i, bpp, out);
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = load128(line + i);
+        __m128i a = load128(line + i - bpp);
+        __m128i predicted;
+
+        switch (type) {
+        case 0: predicted = zero; break;
+        case 1: predicted = a; break;
+        case 2: predicted = load128(prev + i); break;
+        case 3: {
+            // avg rounds up, the filter rounds down
+            __m128i b = load128(prev + i);
+            predicted = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), low_bit));
+            break;
+        }
+        default:
+            predicted = paeth8(a, load128(prev + i), load128(prev + i - bpp));
+            break;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(x, predicted));
+    }
+    filterBytesScalar(type, line, prev, i, size, bpp, out);
+
+    __m128i sum = zero;
+    for (i = 0; i + 16 <= size; i += 16) {
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_abs_epi8(load128(out + i)), zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+
+    return lanes[0] + lanes[1] + filterCostScalar(out + i, size - i);
+}
+
+TARGET("sse4.2")
+static uint32_t matchLengthSse2(const uint8_t* a, const uint8_t* b, uint32_t max) {
+    uint32_t length = 0;
+    for (; length + 16 <= max; length += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + length));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + length));
+        uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0xffff) {
+            return length + countTrailingZeros(~equal);
+        }
+    }
+    return length + matchLengthScalar(a + length, b + length, max - length);
+}
+
+TARGET("avx2")
+static uint32_t matchLengthAvx2(const uint8_t* a, const uint8_t* b, uint32_t max) {
+    uint32_t length = 0;
+    for (; length + 32 <= max; length += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + length));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + length));
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (equal != 0xffffffff) {
+            return length + countTrailingZeros(~equal);
+        }
+    }
+    return length + matchLengthSse2(a + length, b + length, max - length);
+}
+
+TARGET("avx512f,avx512bw")
+static uint32_t matchLengthAvx512(const uint8_t* a, const uint8_t* b, uint32_t max) {
+    uint32_t length = 0;
+    for (; length + 64 <= max; length += 64) {
+        __m512i va = _mm512_loadu_si512(a + length);
+        __m512i vb = _mm512_loadu_si512(b + length);
+        uint64_t equal = _mm512_cmpeq_epi8_mask(va, vb);
+        if (equal != ~0ULL) {
+            return length + countTrailingZeros(~equal);
+        }
+    }
+    return length + matchLengthAvx2(a + length, b + length, max - length);
+}
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+    int result[4];
+    __cpuidex(result, leaf, subleaf);
+    for (int i = 0; i < 4; i++) regs[i] = result[i];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// which register states the operating system saves on context switch
+static uint64_t xgetbv() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax | (uint64_t(edx) << 32);
+#endif
+}
+
+#endif
+
+#if CPU_ARM
+
+#if defined(__clang__)
+#define TARGET_ARM_CRC TARGET("crc")
+#else
+#define TARGET_ARM_CRC TARGET("+crc")
+#endif
+
+TARGET_ARM_CRC
+static uint32_t crc32Arm(const uint8_t* data, size_t size, uint32_t crc) {
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        crc = __crc32d(crc, value);
+    }
+    for (; size > 0; size--, data++) {
+        crc = __crc32b(crc, *data);
+    }
+    return crc;
+}
+
+#endif
+
+namespace Cpu {
+
+    static const Kernels scalar_kernels{
+        Isa::scalar, crc32Scalar, adler32Scalar, packRowScalar, filterRowScalar, matchLengthScalar };
+
+#if CPU_X86
+    static const Kernels sse42_kernels{
+        Isa::sse42, crc32Pclmul, adler32Ssse3, packRowSsse3, filterRowSse41, matchLengthSse2 };
+    static const Kernels avx2_kernels{
+        Isa::avx2, crc32Pclmul, adler32Avx2, packRowAvx2, filterRowSse41, matchLengthAvx2 };
+    static const Kernels avx512_kernels{
+        Isa::avx512, crc32Pclmul, adler32Avx2, packRowAvx2, filterRowSse41, matchLengthAvx512 };
+#endif
+
+#if CPU_ARM
+    static const Kernels armv8_crc_kernels{
+        Isa::armv8_crc, crc32Arm, adler32Scalar, packRowScalar, filterRowScalar, matchLengthScalar };
+#endif
+
+    Isa detect() {
+#if CPU_X86
+        uint32_t regs[4];
+        cpuid(0, 0, regs);
+        uint32_t max_leaf = regs[0];
+
+        cpuid(1, 0, regs);
+        bool pclmul = regs[2] & (1 << 1);
+        bool ssse3 = regs[2] & (1 << 9);
+        bool sse42 = regs[2] & (1 << 20);
+        bool osxsave = regs[2] & (1 << 27);
+        bool avx = regs[2] & (1 << 28);
+        if (!(pclmul && ssse3 && sse42)) return Isa::scalar;
+
+        if (!osxsave || !avx || max_leaf < 7) return Isa::sse42;
+        uint64_t xcr0 = xgetbv();
+        bool ymm = (xcr0 & 0x06) == 0x06;
+        bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+        cpuid(7, 0, regs);
+        bool avx2 = regs[1] & (1 << 5);
+        bool avx512f = regs[1] & (1 << 16);
+        bool avx512bw = regs[1] & (1 << 30);
+
+        if (!ymm || !avx2) return Isa::sse42;
+        if (!zmm || !avx512f || !avx512bw) return Isa::avx2;
+        return Isa::avx512;
+#elif CPU_ARM
+#if defined(__linux__)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32) return Isa::armv8_crc;
+        return Isa::scalar;
+#else
+        return Isa::armv8_crc;
+#endif
+#else
+        return Isa::scalar;
+#endif
+    }
+
+    const char* name(Isa isa) {
+        switch (isa) {
+        case Isa::scalar: return "scalar";
+        case Isa::sse42: return "sse4.2";
+        case Isa::avx2: return "avx2";
+        case Isa::avx512: return "avx512";
+        case Isa::armv8_crc: return "armv8-crc";
+        }
+        return "unknown";
+    }
+
+    // kernel set for isa, if it was compiled in and this cpu runs it
+    static const Kernels* find(Isa isa) {
+        Isa best = detect();
+        switch (isa) {
+        case Isa::scalar: return &scalar_kernels;
+#if CPU_X86
+        case Isa::sse42: return best >= Isa::sse42 && best <= Isa::avx512 ? &sse42_kernels : nullptr;
+        case Isa::avx2: return best >= Isa::avx2 && best <= Isa::avx512 ? &avx2_kernels : nullptr;
+        case Isa::avx512: return best == Isa::avx512 ? &avx512_kernels : nullptr;
+#endif
+#if CPU_ARM
+        case Isa::armv8_crc: return best == Isa::armv8_crc ? &armv8_crc_kernels : nullptr;
+#endif
+        default: return nullptr;
+        }
+    }
+
+    static const Kernels* initial() {
+        Isa best = detect();
+
+        const char* forced = std::getenv("IMAGE_ISA");
+        if (forced) {
+            for (Isa isa : { Isa::scalar, Isa::sse42, Isa::avx2, Isa::avx512, Isa::armv8_crc }) {
+                if (forced == std::string(name(isa)) && find(isa)) {
+                    return find(isa);
+                }
+            }
+            std::cerr << "IMAGE_ISA=" << forced << " not supported, using " << name(best) << "\n";
+        }
+
+        return find(best);
+    }
+
+    static std::atomic<const Kernels*>& active() {
+        static std::atomic<const Kernels*> kernels{ initial() };
+        return kernels;
+    }
+
+    const Kernels& kernels() {
+        return *active().load(std::memory_order_relaxed);
+    }
+
+    bool select(Isa isa) {
+        const Kernels* kernels = find(isa);
+        if (!kernels) return false;
+
+        active().store(kernels, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool check() {
+        const Kernels& tested = kernels();
+        const Kernels& reference = scalar_kernels;
+        bool same = true;
+        auto report = [&](const char* kernel, size_t size) {
+            std::cerr << name(tested.isa) << " " << kernel << " differs from scalar, size " << size << "\n";
+            same = false;
+        };
+
+        // xorshift, so every run checks the same inputs
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        auto random = [&] {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        };
+
+        // sizes around every vector width and the adler32 block, started
+        // at any alignment
+        std::vector<uint8_t> a(70000), b(70000);
+        for (auto& byte : a) byte = static_cast<uint8_t>(random());
+        for (auto& byte : b) byte = static_cast<uint8_t>(random());
+
+        std::vector<size_t> sizes;
+        for (size_t size = 0; size < 300; size++) sizes.push_back(size);
+        for (size_t size : { 1000, 5551, 5552, 5553, 16383, 65536 }) sizes.push_back(size);
+
+        for (size_t size : sizes) {
+            const uint8_t* data = a.data() + random() % 16;
+            uint32_t crc = static_cast<uint32_t>(random());
+            if (tested.crc32(data, size, crc) != reference.crc32(data, size, crc)) report("crc32", size);
+
+            uint32_t adler = reference.adler32(b.data(), random() % 1000, 1);
+            if (tested.adler32(data, size, adler) != reference.adler32(data, size, adler)) report("adler32", size);
+        }
+
+        std::vector<Pixel> pixels(1000);
+        for (auto& pixel : pixels) {
+            uint64_t value = random();
+            std::memcpy(&pixel, &value, sizeof(pixel));
+        }
+
+        // outputs start poisoned and must match past the end as well
+        for (size_t count : { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000 }) {
+            for (int format = 0; format < 4; format++) {
+                bool alpha = format & 1;
+                bool eight_bit = format & 2;
+                std::vector<uint8_t> out(count * 8 + 64, 0xAA), expected(count * 8 + 64, 0xAA);
+                tested.pack_row(pixels.data(), count, alpha, eight_bit, out.data());
+                reference.pack_row(pixels.data(), count, alpha, eight_bit, expected.data());
+                if (out != expected) report("pack_row", count);
+            }
+
+            for (size_t bpp : { 3, 4, 6, 8 }) {
+                size_t size = std::min<size_t>(count * bpp, a.size() - 16);
+                for (uint8_t type = 0; type < 5; type++) {
+                    for (int above = 0; above < 2; above++) {
+                        const uint8_t* prev = above ? b.data() + 5 : nullptr;
+                        std::vector<uint8_t> out(size + 64, 0xAA), expected(size + 64, 0xAA);
+                        uint64_t cost = tested.filter_row(type, a.data() + 3, prev, size, bpp, out.data());
+                        uint64_t expected_cost = reference.filter_row(type, a.data() + 3, prev, size, bpp, expected.data());
+                        if (cost != expected_cost || out != expected) report("filter_row", size);
+                    }
+                }
+            }
+        }
+
+        // a copy with one byte changed somewhere in or just past the range
+        std::vector<uint8_t> copy(a);
+        for (uint32_t max = 0; max < 600; max++) {
+            size_t start = random() % 16;
+            size_t changed = start + random() % (max + 8);
+            copy[changed] ^= 0x10;
+            if (tested.match_length(a.data() + start, copy.data() + start, max)
+                != reference.match_length(a.data() + start, copy.data() + start, max)) report("match_length", max);
+            copy[changed] ^= 0x10;
+        }
+
+        return same;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+struct Pixel;
+
+// runtime selection of the hot encoding loops for the cpu we are running on
+// the scalar kernels are the reference, every other set must match their output
+namespace Cpu {
+
+    enum class Isa {
+        scalar,
+        sse42, // sse4.2 + ssse3 + pclmul
+        avx2,
+        avx512, // avx512f + avx512bw
+        // aarch64 crc32 instructions.  Only crc32 is accelerated, the other
+        // kernels stay scalar until neon versions of them are written
+        armv8_crc
+    };
+
+    struct Kernels {
+        Isa isa;
+
+        // running checksums, without the final inversion for crc
+        uint32_t (*crc32)(const uint8_t* data, size_t size, uint32_t crc);
+        uint32_t (*adler32)(const uint8_t* data, size_t size, uint32_t adler);
+
+        // big endian samples for one row, 3 or 4 channels of 8 or 16 bits
+        void (*pack_row)(const Pixel* pixels, size_t count, bool alpha, bool eight_bit, uint8_t* out);
+
+        // applies png filter type 0-4 to one row of bytes, bpp bytes per pixel
+        // prev is the unfiltered row above, null for a row of zeros
+        // returns the sum of the filtered bytes taken as signed, the usual cost heuristic
+        uint64_t (*filter_row)(uint8_t type, const uint8_t* line, const uint8_t* prev, size_t size, size_t bpp, uint8_t* out);
+
+        // number of equal leading bytes of a and b, at most max
+        uint32_t (*match_length)(const uint8_t* a, const uint8_t* b, uint32_t max);
+    };
+
+    // best instruction set supported by this cpu and operating system
+    Isa detect();
+
+    const char* name(Isa isa);
+
+    // kernels in use, chosen on first call from detect(), or from the
+    // IMAGE_ISA environment variable (scalar, sse4.2, avx2, avx512, armv8-crc)
+    const Kernels& kernels();
+
+    // force a kernel set, false if it is not supported here
+    bool select(Isa isa);
+
+    // runs the kernels in use next to the scalar ones on generated inputs,
+    // reporting any difference to stderr; false if there were any
+    bool check();
+}
@@ -4,22 +4,43 @@
 #include <array>
 
 #include "png.hpp"
+#include "cpu.hpp"
+
+// compares every kernel set this cpu runs against the scalar reference
+static int checkKernels() {
+    bool same = true;
+    for (auto isa : { Cpu::Isa::scalar, Cpu::Isa::sse42, Cpu::Isa::avx2, Cpu::Isa::avx512, Cpu::Isa::armv8_crc }) {
+        if (!Cpu::select(isa)) {
+            std::cout << Cpu::name(isa) << ": not supported\n";
+            continue;
+        }
+
+        bool ok = Cpu::check();
+        std::cout << Cpu::name(isa) << (ok ? ": ok\n" : ": differs\n");
+        same = same && ok;
+    }
+    return same ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--check-kernels") {
+        return checkKernels();
+    }
 
-int main() {
     std::vector<std::vector<Pixel>> data{};
 
     size_t width = 1920;
     size_t height = 1080;
-    for (size_t x = 0; x < width; x++) {
+    for (size_t y = 0; y < height; y++) {
         auto row = std::vector<Pixel>();
-        for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
             row.push_back(Pixel::HSV(360.0 / width * x, 0.5, 1.0 / height * y));
         }
         data.push_back(row);
     }
     
-    std::cout << "width: " << data.size() << "\n"
-        << "height: " << data[0].size() << "\n";
+    std::cout << "width: " << data[0].size() << "\n"
+        << "height: " << data.size() << "\n";
 
     PNGImage image{};
     image.background({ 0, 0, 0 });
@@ -28,7 +49,8 @@ int main() {
     image.modification_time();
     image.no_alpha();
     image.data(std::move(data));
-    image.write(std::ofstream("image.png", std::ios::binary));
+    std::ofstream file("image.png", std::ios::binary);
+    image.write(file);
 
     return 0;
 }
@@ -1,4 +1,5 @@
 ﻿#include "png.hpp"
+#include "cpu.hpp"
 
 #include <numeric>
 #include <cmath>
@@ -7,37 +8,85 @@
 #include <algorithm>
 #include <codecvt>
 #include <ctime>
+#include <cstring>
+#include <cstdio>
+#include <deque>
+#include <condition_variable>
+#include <thread>
+#include <random>
+#include <functional>
+#include <exception>
+#include <filesystem>
 
 uint16_t clamp(double val) {
     return static_cast<uint16_t>(std::round(val * UINT16_MAX));
 }
 
-static uint32_t crc32(uint32_t data, uint32_t prev = 0) {
-    uint32_t polynomial = 0xEDB88320L;
-    static uint32_t table[256];
-    static bool tableInitialised = false;
+static uint32_t crc32(const uint8_t* data, size_t size, uint32_t prev) {
+    return Cpu::kernels().crc32(data, size, prev);
+}
 
-    if (!tableInitialised) {
-        tableInitialised = true;
-        for (uint32_t i = 0; i <= 0xFF; i++) {
-            uint32_t crc = i;
-            for (uint32_t j = 0; j < 8; j++) {
-                crc = (crc >> 1) ^ (-int(crc & 1) & polynomial);
-            }
-            table[i] = crc;
-        }
+static uint32_t gf2MatrixTimes(const uint32_t* matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1) sum ^= *matrix;
     }
+    return sum;
+}
 
-    return (prev >> 8) ^ table[(prev ^ data) & 0xff];
+static void gf2MatrixSquare(uint32_t* square, const uint32_t* matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2MatrixTimes(matrix, matrix[n]);
+    }
 }
 
-CrcStream CrcStream::operator<<(uint8_t data) {
+// crc of the concatenation of two buffers, given each buffer's final crc
+// and the length of the second buffer, see zlib's crc32_combine
+static uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+    if (size2 == 0) return crc1;
+
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    // operator for one zero bit
+    odd[0] = 0xEDB88320L;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd); // two zero bits
+    gf2MatrixSquare(odd, even); // four zero bits
+
+    // apply size2 zero bytes to crc1
+    do {
+        gf2MatrixSquare(even, odd);
+        if (size2 & 1) crc1 = gf2MatrixTimes(even, crc1);
+        size2 >>= 1;
+        if (size2 == 0) break;
+
+        gf2MatrixSquare(odd, even);
+        if (size2 & 1) crc1 = gf2MatrixTimes(odd, crc1);
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+CrcStream& CrcStream::operator<<(uint8_t data) {
     stream << data;
-    crc = crc32(data, crc);
+    if (compute) crc = crc32(&data, 1, crc);
+    return *this;
+}
+
+CrcStream& CrcStream::write(const std::vector<uint8_t>& data) {
+    stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (compute) crc = crc32(data.data(), data.size(), crc);
     return *this;
 }
 
-CrcStream CrcStream::operator<<(std::string data) {
+CrcStream& CrcStream::operator<<(std::string data) {
     for (uint8_t c : data) {
         this->operator<<(c);
     }
@@ -134,57 +183,265 @@ Pixel Pixel::HSV(double H, double S, double V) {
 // see zlib source code
 // (C) 1995-2017 Jean-loup Gailly and Mark Adler
 
-std::vector<uint8_t> zlibCompress(const std::vector<uint8_t>& data) {
-    std::vector<uint8_t> compressed;
+// largest prime smaller than 65536
+constexpr const uint32_t ADLER_BASE = 65521U;
 
-    uint16_t header = 0;
-    header |= (0 & 0xF) << 12; // info
-    header |= (8 & 0xF) << 8; // method
-    header |= (0 & 0x3) << 6; // level
-    header |= (0 & 0x1) << 5; // dict
-    header += 31 - (header % 31); // check
+static uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1) {
+    return Cpu::kernels().adler32(data, size, adler);
+}
 
-    compressed.push_back(header >> 8);
-    compressed.push_back(header & 0xff);
+// checksum of the concatenation of two buffers, given each buffer's checksum
+// and the length of the second buffer
+static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+    uint64_t rem = size2 % ADLER_BASE;
+    uint64_t sum1 = adler1 & 0xffff;
+    uint64_t sum2 = (rem * sum1) % ADLER_BASE;
 
-    // todo: implement deflate, compressed.push_back() here
+    sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + ADLER_BASE - rem;
 
-    // adler32 checksum
-    // largest prime smaller than 65536
-    constexpr const uint32_t BASE = 65521U;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if (sum2 >= (ADLER_BASE << 1)) sum2 -= (ADLER_BASE << 1);
+    if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
 
-    // NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1
-    constexpr const uint32_t NMAX = 5552;
+    return static_cast<uint32_t>(sum1 | (sum2 << 16));
+}
 
-    uint64_t adler = 1;
-    uint64_t sum2 = 0;
-    
-    size_t count = 0;
-    for (; count < data.size(); count += NMAX) {
-        for (size_t i = 0; i < NMAX; i++) {
-            adler += data[count + i]; sum2 += adler;
+// deflate writes bits least significant first, huffman codes most significant first
+class BitWriter {
+    std::vector<uint8_t>& out;
+    uint32_t buffer;
+    int count;
+
+public:
+    BitWriter(std::vector<uint8_t>& out) : out(out), buffer(0), count(0) {}
+
+    void bits(uint32_t value, int length) {
+        buffer |= value << count;
+        count += length;
+        while (count >= 8) {
+            out.push_back(buffer & 0xff);
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void code(uint32_t code, int length) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
         }
+        bits(reversed, length);
+    }
+
+    void align() {
+        if (count > 0) {
+            out.push_back(buffer & 0xff);
+        }
+        buffer = 0;
+        count = 0;
+    }
+
+    // bits written so far
+    size_t size() const {
+        return out.size() * 8 + count;
+    }
+};
+
+static void fixedLiteral(BitWriter& out, uint32_t symbol) {
+    if (symbol < 144) {
+        out.code(0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        out.code(0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        out.code(symbol - 256, 7);
+    } else {
+        out.code(0xC0 + symbol - 280, 8);
+    }
+}
+
+static void fixedMatch(BitWriter& out, uint32_t length, uint32_t distance) {
+    static const uint16_t length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t distance_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t distance_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    int l = 28;
+    while (length_base[l] > length) l--;
+    fixedLiteral(out, 257 + l);
+    out.bits(length - length_base[l], length_extra[l]);
+
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    out.code(d, 5);
+    out.bits(distance - distance_base[d], distance_extra[d]);
+}
+
+// bytes used by the match finder's hash chains
+static size_t matchTableSize(int window_bits, int hash_bits) {
+    return sizeof(int32_t) * ((size_t(1) << window_bits) + (size_t(1) << hash_bits));
+}
+
+// lz77 with hash chains over a window of up to 32k, emitted as a single fixed huffman block
+static void deflateFixed(const std::vector<uint8_t>& data, BitWriter& out, int window_bits, int hash_bits, size_t start = 0) {
+    constexpr const int MAX_CHAIN = 32;
+    constexpr const uint32_t MIN_MATCH = 3;
+    constexpr const uint32_t MAX_MATCH = 258;
+    const int32_t WINDOW_SIZE = 1 << window_bits;
+    const int HASH_BITS = hash_bits;
+
+    std::vector<int32_t> head(size_t(1) << HASH_BITS, -1);
+    std::vector<int32_t> prev(WINDOW_SIZE, -1);
+
+    auto& cpu = Cpu::kernels();
 
-        adler %= BASE;
-        sum2 %= BASE;
+    auto hash = [&](size_t i) {
+        uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        return (v * 2654435761U) >> (32 - HASH_BITS);
+    };
+    auto insert = [&](size_t i) {
+        uint32_t h = hash(i);
+        prev[i & (WINDOW_SIZE - 1)] = head[h];
+        head[h] = static_cast<int32_t>(i);
+    };
+
+    out.bits(0, 1); // not final, see zlibTrailer
+    out.bits(1, 2); // fixed huffman
+
+    size_t size = data.size();
+
+    // bytes before start are only matched against, as if a previous block
+    // had coded them; just the last window of them can be reached
+    size_t i = start > size_t(WINDOW_SIZE) ? start - WINDOW_SIZE : 0;
+    for (; i < start; i++) {
+        if (i + MIN_MATCH <= size) insert(i);
     }
 
-    if (count > 0) {
-        for (size_t i = 0; i < count; i++) {
-            adler += data[count + i]; sum2 += adler;
+    while (i < size) {
+        uint32_t best_length = 0;
+        uint32_t best_distance = 0;
+
+        if (i + MIN_MATCH <= size) {
+            uint32_t max_length = static_cast<uint32_t>(std::min<size_t>(MAX_MATCH, size - i));
+            int32_t candidate = head[hash(i)];
+            int chain = MAX_CHAIN;
+
+            while (candidate >= 0 && int32_t(i) - candidate < WINDOW_SIZE && chain-- > 0) {
+                uint32_t length = cpu.match_length(&data[candidate], &data[i], max_length);
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = static_cast<uint32_t>(i - candidate);
+                    if (length == max_length) break;
+                }
+
+                int32_t next = prev[candidate & (WINDOW_SIZE - 1)];
+                if (next >= candidate) break;
+                candidate = next;
+            }
         }
 
-        adler %= BASE;
-        sum2 %= BASE;
+        if (best_length >= MIN_MATCH) {
+            fixedMatch(out, best_length, best_distance);
+            for (size_t end = i + best_length; i < end; i++) {
+                if (i + MIN_MATCH <= size) insert(i);
+            }
+        } else {
+            fixedLiteral(out, data[i]);
+            if (i + MIN_MATCH <= size) insert(i);
+            i++;
+        }
     }
 
-    uint32_t adler32 = adler | (sum2 << 16);
+    fixedLiteral(out, 256); // end of block
+}
 
-    compressed.push_back((adler32 >> 24) & 0xff);
-    compressed.push_back((adler32 >> 16) & 0xff);
-    compressed.push_back((adler32 >> 8) & 0xff);
-    compressed.push_back(adler32 & 0xff);
+static void deflateStored(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        uint16_t length = static_cast<uint16_t>(std::min<size_t>(UINT16_MAX, data.size() - offset));
+        out.push_back(0); // not final, stored, padding
+        out.push_back(length & 0xff);
+        out.push_back(length >> 8);
+        out.push_back(~length & 0xff);
+        out.push_back((~length >> 8) & 0xff);
+        out.insert(out.end(), data.begin() + offset, data.begin() + offset + length);
+        offset += length;
+    }
+}
 
+// size of data in stored blocks, the most deflateSegment ever returns
+static size_t storedSize(size_t size) {
+    return size + 5 * (size / UINT16_MAX + 1);
+}
+
+// compresses data into non-final deflate blocks ending on a byte boundary,
+// so independently compressed segments can be concatenated into one stream
+static std::vector<uint8_t> deflateSegment(const std::vector<uint8_t>& data, int window_bits = 15, int hash_bits = 15) {
+    std::vector<uint8_t> compressed;
+    if (data.empty()) return compressed;
+
+    BitWriter bits(compressed);
+    deflateFixed(data, bits, window_bits, hash_bits);
+
+    // empty stored block to flush to a byte boundary
+    bits.bits(0, 3);
+    bits.align();
+    compressed.push_back(0x00);
+    compressed.push_back(0x00);
+    compressed.push_back(0xff);
+    compressed.push_back(0xff);
+
+    // fall back to storing incompressible data
+    if (compressed.size() > storedSize(data.size())) {
+        compressed.clear();
+        deflateStored(data, compressed);
+    }
+
+    return compressed;
+}
+
+// bits deflateFixed spends on the data after start, without the block
+// header and end code, with the bytes before start priming the match window
+static size_t deflatedBits(const std::vector<uint8_t>& data, size_t start, int window_bits, int hash_bits) {
+    std::vector<uint8_t> compressed;
+    BitWriter bits(compressed);
+    deflateFixed(data, bits, window_bits, hash_bits, start);
+    return std::min(bits.size() - 3 - 7, storedSize(data.size() - start) * 8);
+}
+
+static std::vector<uint8_t> zlibHeader() {
+    std::vector<uint8_t> compressed;
+
+    uint16_t header = 0;
+    header |= (7 & 0xF) << 12; // info, 32k window
+    header |= (8 & 0xF) << 8; // method
+    header |= (0 & 0x3) << 6; // level
+    header |= (0 & 0x1) << 5; // dict
+    header += 31 - (header % 31); // check
+
+    compressed.push_back(header >> 8);
+    compressed.push_back(header & 0xff);
+
+    return compressed;
+}
+
+// empty final block and checksum, ends a stream built from deflateSegment
+static std::vector<uint8_t> zlibTrailer(uint32_t adler) {
+    std::vector<uint8_t> compressed{ 0x03, 0x00 };
+
+    compressed.push_back((adler >> 24) & 0xff);
+    compressed.push_back((adler >> 16) & 0xff);
+    compressed.push_back((adler >> 8) & 0xff);
+    compressed.push_back(adler & 0xff);
 
     return compressed;
 }
@@ -203,18 +460,18 @@ static void WriteBigEndian(t& file, uint16_t num) {
 }
 
 Chunk::Chunk(uint32_t length, std::string type, uint32_t crc) :
-    length(length), type(type), crc(crc) {};
+    length(length), type(type), crc(crc), has_crc(false) {};
 
 void Chunk::write(std::ostream& file, struct PNGImage& image) {
     compute(image);
 
     WriteBigEndian(file, length);
-    file << type;
 
-    CrcStream stream(file);
+    CrcStream stream(file, !has_crc);
+    stream << type;
     write_data(stream, image);
 
-    WriteBigEndian(file, stream.get_crc());
+    WriteBigEndian(file, has_crc ? crc : stream.get_crc());
 }
 
 void Chunks::IHDR::write_data(CrcStream& out, struct PNGImage& image) {
@@ -227,49 +484,375 @@ void Chunks::IHDR::write_data(CrcStream& out, struct PNGImage& image) {
         << interlace_method;
 }
 
-void Chunks::IDAT::compute(struct PNGImage& image) {
-    size_t byte_count = image.use_alpha ? 4 : 3;
-    byte_count *= image.use_8_bit ? 1 : 2;
-    byte_count *= data[0].size();
-    byte_count += 1;
-    byte_count *= data.size();
-
-    std::vector<uint8_t> uncompressed;
-
-    for (auto& line : data) {
-        // None filtering (others todo)
-        uncompressed.push_back(0);
-
-        for (auto& pixel : line) {
-            if (image.use_8_bit) {
-                uncompressed.push_back(pixel.r / UINT16_MAX * UINT8_MAX);
-                uncompressed.push_back(pixel.g / UINT16_MAX * UINT8_MAX);
-                uncompressed.push_back(pixel.b / UINT16_MAX * UINT8_MAX);
-                if (image.use_alpha) {
-                    uncompressed.push_back(pixel.a / UINT16_MAX * UINT8_MAX);
+// bytes of one filtered scanline
+static size_t lineSize(size_t width, const PNGImage& image) {
+    size_t pixel_size = image.use_alpha ? 4 : 3;
+    pixel_size *= image.use_8_bit ? 1 : 2;
+    return 1 + pixel_size * width;
+}
+
+// filtered scanlines for count rows of data starting at first
+static std::vector<uint8_t> packRows(const std::vector<std::vector<Pixel>>& data, size_t first, size_t count, const PNGImage& image) {
+    size_t pixel_size = image.use_alpha ? 4 : 3;
+    pixel_size *= image.use_8_bit ? 1 : 2;
+
+    size_t width = count == 0 ? 0 : data[first].size();
+    size_t row_size = pixel_size * width;
+    size_t line_size = 1 + row_size;
+
+    std::vector<uint8_t> uncompressed(line_size * count);
+    auto& cpu = Cpu::kernels();
+
+    std::vector<uint8_t> row(row_size);
+    std::vector<uint8_t> prev(row_size);
+    std::vector<uint8_t> candidate(row_size);
+
+    for (size_t y = 0; y < count; y++) {
+        uint8_t* line = &uncompressed[y * line_size];
+        cpu.pack_row(data[first + y].data(), width, image.use_alpha, image.use_8_bit, row.data());
+
+        // pick the filter with the smallest sum of absolute differences.
+        // The first row only uses filters that ignore the row above, so
+        // every call compresses independently of the rows before it.
+        uint8_t types = y == 0 ? 2 : 5;
+        uint64_t best = UINT64_MAX;
+        for (uint8_t type = 0; type < types; type++) {
+            uint64_t cost = cpu.filter_row(type, row.data(), prev.data(), row_size, pixel_size, candidate.data());
+            if (cost < best) {
+                best = cost;
+                line[0] = type;
+                std::copy(candidate.begin(), candidate.end(), line + 1);
+            }
+        }
+
+        std::swap(row, prev);
+    }
+
+    return uncompressed;
+}
+
+// bump when the compressed output for the same pixels changes,
+// so stale entries in on-disk caches are not reused
+constexpr const uint64_t ENCODER_VERSION = 6;
+
+// filtered bytes per independently compressed IDAT segment.  Every segment
+// starts with an empty match window, ends with a 5 byte flush and limits its
+// first row to None or Sub, which costs a little ratio; in return changed
+// rows only recompress their own segments, and segments compress in parallel.
+// Against one segment per image, 32K segments cost up to 19% on 512x512
+// test images, 256K segments at most 2%.
+constexpr const size_t IDAT_SEGMENT_BYTES = 256 * 1024;
+
+// full width rows per segment
+static size_t segmentRows(const std::vector<std::vector<Pixel>>& data, const PNGImage& image) {
+    return std::max<size_t>(1, IDAT_SEGMENT_BYTES / lineSize(data[0].size(), image));
+}
+
+static uint64_t hashMix(uint64_t hash, uint64_t value) {
+    hash ^= value;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+// hash of some rows plus every setting that affects their compressed bytes
+static uint64_t hashRows(const std::vector<std::vector<Pixel>>& data, size_t first, size_t count, const PNGImage& image) {
+    uint64_t hash = hashMix(0, ENCODER_VERSION);
+    hash = hashMix(hash, count);
+    hash = hashMix(hash, data[first].size());
+    hash = hashMix(hash, (image.use_alpha ? 1 : 0) | (image.use_8_bit ? 2 : 0) | (image.use_interlace ? 4 : 0));
+    hash = hashMix(hash, (image.plan.window_bits << 8) | image.plan.hash_bits);
+
+    for (size_t y = first; y < first + count; y++) {
+        for (auto& pixel : data[y]) {
+            uint64_t value;
+            static_assert(sizeof(Pixel) == sizeof(value), "Pixel is four 16 bit samples");
+            std::memcpy(&value, &pixel, sizeof(value));
+            hash = hashMix(hash, value);
+        }
+    }
+
+    return hash;
+}
+
+// adam7 passes: first column, first row, column step, row step
+constexpr const size_t ADAM7[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}
+};
+
+// columns or rows of a reduced adam7 image
+static size_t passSize(size_t size, size_t first, size_t step) {
+    return size > first ? (size - first + step - 1) / step : 0;
+}
+
+// rows compressed as one segment, of the image or of one adam7 pass
+struct SegmentSpan {
+    int pass; // -1 for the full image
+    size_t first;
+    size_t count;
+};
+
+// segments of at most segment_rows full width rows, in the order they are
+// written; narrower adam7 passes take proportionally more rows a segment,
+// and passes without pixels have no scanlines at all
+static std::vector<SegmentSpan> segmentSpans(const std::vector<std::vector<Pixel>>& data, size_t segment_rows, bool interlaced) {
+    std::vector<SegmentSpan> spans;
+
+    if (!interlaced) {
+        for (size_t first = 0; first < data.size(); first += segment_rows) {
+            spans.push_back({-1, first, std::min(segment_rows, data.size() - first)});
+        }
+        return spans;
+    }
+
+    for (int pass = 0; pass < 7; pass++) {
+        auto& p = ADAM7[pass];
+        size_t width = passSize(data[0].size(), p[0], p[2]);
+        size_t height = passSize(data.size(), p[1], p[3]);
+        if (width == 0) continue;
+
+        size_t rows = std::max<size_t>(1, segment_rows * data[0].size() / width);
+        for (size_t first = 0; first < height; first += rows) {
+            spans.push_back({pass, first, std::min(rows, height - first)});
+        }
+    }
+    return spans;
+}
+
+// pixels of a pass span, copied out of the image a row at a time so each
+// source row is read front to back
+static std::vector<std::vector<Pixel>> gatherPass(const std::vector<std::vector<Pixel>>& data, const SegmentSpan& span) {
+    auto& p = ADAM7[span.pass];
+    size_t width = passSize(data[0].size(), p[0], p[2]);
+
+    std::vector<std::vector<Pixel>> rows(span.count, std::vector<Pixel>(width));
+    for (size_t y = 0; y < span.count; y++) {
+        const Pixel* source = data[p[1] + (span.first + y) * p[3]].data() + p[0];
+        Pixel* out = rows[y].data();
+        for (size_t x = 0; x < width; x++) {
+            out[x] = source[x * p[2]];
+        }
+    }
+
+    return rows;
+}
+
+// bytes gatherPass holds for a span
+static size_t gatheredSize(const std::vector<std::vector<Pixel>>& data, const SegmentSpan& span) {
+    if (span.pass < 0) return 0;
+    auto& p = ADAM7[span.pass];
+    return span.count * passSize(data[0].size(), p[0], p[2]) * sizeof(Pixel);
+}
+
+// bytes packSpan returns for a span
+static size_t spanSize(const std::vector<std::vector<Pixel>>& data, const SegmentSpan& span, const PNGImage& image) {
+    size_t width = data[0].size();
+    if (span.pass >= 0) {
+        auto& p = ADAM7[span.pass];
+        width = passSize(width, p[0], p[2]);
+    }
+    return span.count * lineSize(width, image);
+}
+
+// filtered scanlines of a span
+static std::vector<uint8_t> packSpan(const std::vector<std::vector<Pixel>>& data, const SegmentSpan& span, const PNGImage& image) {
+    if (span.pass < 0) {
+        return packRows(data, span.first, span.count, image);
+    }
+    return packRows(gatherPass(data, span), 0, span.count, image);
+}
+
+// threads that are always joined, even when the caller or one of them
+// throws.  The first exception a thread throws runs stop, so the others can
+// give up early, and is rethrown by join.
+class ThreadGroup {
+    std::vector<std::thread> threads;
+    std::function<void()> stop;
+    std::mutex lock;
+    std::exception_ptr error;
+
+public:
+    ThreadGroup(std::function<void()> stop) : stop(std::move(stop)) {}
+
+    ~ThreadGroup() {
+        if (threads.empty()) return;
+        stop();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    template<typename F>
+    void spawn(F work) {
+        threads.emplace_back([this, work] {
+            try {
+                work();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (!error) error = std::current_exception();
                 }
+                stop();
+            }
+        });
+    }
+
+    void join() {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+static uint32_t crcOf(const std::string& type, const std::vector<uint8_t>& bytes) {
+    uint32_t crc = crc32(reinterpret_cast<const uint8_t*>(type.data()), type.size(), ~0U);
+    return ~crc32(bytes.data(), bytes.size(), crc);
+}
+
+// compresses filtered rows into segment, along with the checksums needed
+// to splice it into a zlib stream and an IDAT chunk
+static void compressSegment(Chunks::IDATSegment& segment, const std::vector<uint8_t>& uncompressed, int window_bits = 15, int hash_bits = 15) {
+    segment.size = uncompressed.size();
+    segment.adler = adler32(uncompressed.data(), uncompressed.size());
+    segment.bytes = deflateSegment(uncompressed, window_bits, hash_bits);
+    segment.crc = ~crc32(segment.bytes.data(), segment.bytes.size(), ~0U);
+}
+
+// writes a segment as its own IDAT chunk, the first of a stream after the
+// zlib header, and adds it to the stream's adler32.  Takes the segment's bytes
+static void writeSegment(std::ostream& file, PNGImage& image, int id, Chunks::IDATSegment& segment, bool first, uint32_t& adler) {
+    auto bytes = std::move(segment.bytes);
+    if (first) {
+        auto header = zlibHeader();
+        bytes.insert(bytes.begin(), header.begin(), header.end());
+    }
+
+    Chunks::IDAT(std::move(bytes), id).write(file, image);
+    adler = adler32Combine(adler, segment.adler, segment.size);
+}
+
+// compresses the rows in segments, reusing the output of segments whose rows
+// have not changed since the previous compute, then splices the segments into
+// one zlib stream, combining their checksums instead of recalculating them
+void Chunks::IDAT::compute(struct PNGImage& image) {
+    // pre-compressed strip
+    if (data.empty()) return;
+
+    auto& plan = image.plan;
+    auto& meter = image.meter;
+
+    // kept from the previous write
+    for (auto& segment : segments) {
+        meter.add(segment.bytes.size());
+    }
+
+    size_t segment_rows = segmentRows(data, image);
+    auto spans = segmentSpans(data, segment_rows, image.use_interlace);
+
+    // the cache key covers the whole image, so it is known before any
+    // pass is gathered
+    CacheKey key{};
+    if (image.encode_cache) {
+        uint64_t flags = (image.use_alpha ? 1 : 0) | (image.use_8_bit ? 2 : 0) | (image.use_interlace ? 4 : 0);
+        uint64_t bits = (plan.window_bits << 8) | plan.hash_bits;
+        key = image.encode_cache->key(data, {ENCODER_VERSION, flags, bits, segment_rows});
+
+        if (image.encode_cache->find(key, bytes)) {
+            // the segments no longer describe the last output
+            for (auto& segment : segments) {
+                meter.remove(segment.bytes.size());
+            }
+            segments.clear();
+            meter.add(bytes.size());
+
+            length = static_cast<uint32_t>(bytes.size());
+            has_crc = false;
+            return;
+        }
+    }
+
+    segments.resize(spans.size());
+
+    // plan.threads workers take segments in turn, so the passes of an
+    // interlaced image are compressed alongside each other
+    std::atomic<size_t> next(0);
+    ThreadGroup workers([&] { next = spans.size(); });
+    auto work = [&] {
+        size_t tables = matchTableSize(plan.window_bits, plan.hash_bits);
+        for (size_t n = next++; n < spans.size(); n = next++) {
+            auto& span = spans[n];
+            auto& segment = segments[n];
+
+            std::vector<std::vector<Pixel>> gathered;
+            uint64_t hash;
+            if (span.pass < 0) {
+                hash = hashRows(data, span.first, span.count, image);
             } else {
-                uncompressed.push_back(pixel.r >> 8);
-                uncompressed.push_back(pixel.r & 0xff);
-                uncompressed.push_back(pixel.g >> 8);
-                uncompressed.push_back(pixel.g & 0xff);
-                uncompressed.push_back(pixel.b >> 8);
-                uncompressed.push_back(pixel.b & 0xff);
-                if (image.use_alpha) {
-                    uncompressed.push_back(pixel.a >> 8);
-                    uncompressed.push_back(pixel.a & 0xff);
-                }
+                gathered = gatherPass(data, span);
+                hash = hashMix(hashRows(gathered, 0, span.count, image), span.pass);
+            }
+
+            size_t pixels = gatheredSize(data, span);
+            meter.add(pixels);
+            if (segment.hash == hash && !segment.bytes.empty()) {
+                meter.remove(pixels);
+                continue;
             }
+
+            auto uncompressed = span.pass < 0
+                ? packRows(data, span.first, span.count, image)
+                : packRows(gathered, 0, span.count, image);
+            meter.add(uncompressed.size() + tables);
+            size_t previous = segment.bytes.size();
+            compressSegment(segment, uncompressed, plan.window_bits, plan.hash_bits);
+            segment.hash = hash;
+            segment.rows = static_cast<uint32_t>(span.count);
+            meter.add(segment.bytes.size());
+            meter.remove(previous);
+
+            meter.remove(uncompressed.size() + tables + pixels);
         }
+    };
+
+    for (size_t t = 1; t < std::min(plan.threads, spans.size()); t++) {
+        workers.spawn(work);
     }
+    work();
+    workers.join();
+
+    bytes = zlibHeader();
+    crc = crcOf(type, bytes);
+    uint32_t adler = 1;
+    for (auto& segment : segments) {
+        bytes.insert(bytes.end(), segment.bytes.begin(), segment.bytes.end());
+        crc = crc32Combine(crc, segment.crc, segment.bytes.size());
+        adler = adler32Combine(adler, segment.adler, segment.size);
+    }
+
+    auto trailer = zlibTrailer(adler);
+    bytes.insert(bytes.end(), trailer.begin(), trailer.end());
+    crc = crc32Combine(crc, ~crc32(trailer.data(), trailer.size(), ~0U), trailer.size());
+    meter.add(bytes.size());
+
+    length = static_cast<uint32_t>(bytes.size());
+    has_crc = true;
 
-    bytes = zlibCompress(std::move(uncompressed));
-    length = bytes.size();
+    if (image.encode_cache) {
+        image.encode_cache->insert(key, bytes);
+    }
 }
 
 void Chunks::IDAT::write_data(CrcStream& out, PNGImage& image) {
-    for (auto c : bytes) {
-        out << c;
+    out.write(bytes);
+
+    // the segments are enough to rebuild the stream on the next write
+    if (!data.empty()) {
+        image.meter.remove(bytes.size());
+        bytes.clear();
+        bytes.shrink_to_fit();
     }
 }
 
@@ -401,8 +984,263 @@ void Chunks::tRNS::write_data(CrcStream& out, struct PNGImage& image) {
     WriteBigEndian(out, color.b);
 }
 
+void MemoryMeter::add(size_t bytes) {
+    size_t now = current += bytes;
+    size_t peak = high;
+    while (now > peak && !high.compare_exchange_weak(peak, now)) {}
+}
+
+void MemoryMeter::remove(size_t bytes) {
+    current -= bytes;
+}
+
+void MemoryMeter::reset() {
+    current = 0;
+    high = 0;
+}
+
+// siphash-2-4 with 128 bit output, over whole 64 bit words
+class SipHash128 {
+    uint64_t v0, v1, v2, v3;
+    uint64_t words;
+
+    static uint64_t rotate(uint64_t x, int bits) {
+        return (x << bits) | (x >> (64 - bits));
+    }
+
+    void round() {
+        v0 += v1; v1 = rotate(v1, 13); v1 ^= v0; v0 = rotate(v0, 32);
+        v2 += v3; v3 = rotate(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotate(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotate(v1, 17); v1 ^= v2; v2 = rotate(v2, 32);
+    }
+
+public:
+    SipHash128(const uint64_t key[2]) :
+        v0(0x736f6d6570736575ULL ^ key[0]), v1(0x646f72616e646f6dULL ^ key[1] ^ 0xee),
+        v2(0x6c7967656e657261ULL ^ key[0]), v3(0x7465646279746573ULL ^ key[1]), words(0) {}
+
+    void add(uint64_t word) {
+        v3 ^= word;
+        round();
+        round();
+        v0 ^= word;
+        words++;
+    }
+
+    CacheKey finish() {
+        uint64_t last = words << 59;
+        v3 ^= last;
+        round();
+        round();
+        v0 ^= last;
+
+        CacheKey key;
+        v2 ^= 0xee;
+        for (int i = 0; i < 4; i++) round();
+        key.low = v0 ^ v1 ^ v2 ^ v3;
+        v1 ^= 0xdd;
+        for (int i = 0; i < 4; i++) round();
+        key.high = v0 ^ v1 ^ v2 ^ v3;
+        return key;
+    }
+};
+
+EncodeCache::EncodeCache(size_t max_bytes, std::string directory) :
+    max_bytes(max_bytes), used_bytes(0), directory(directory),
+    hit_count(0), miss_count(0) {
+    std::random_device random;
+    for (auto& word : secret) {
+        word = (static_cast<uint64_t>(random()) << 32) ^ random();
+    }
+
+    if (!this->directory.empty()) load_secret();
+}
+
+// the first cache to use a directory stores its secret there, every later
+// one reads it back
+void EncodeCache::load_secret() {
+    std::string name = directory + "/secret";
+    std::ifstream file(name, std::ios::binary);
+
+    if (!file) {
+        std::string temporary = name + "." + std::to_string(std::random_device()()) + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(secret), sizeof secret);
+        out.close();
+
+        // unlike a rename, linking fails if another process got there first
+        std::error_code error;
+        if (out) std::filesystem::create_hard_link(temporary, name, error);
+        std::remove(temporary.c_str());
+        file.open(name, std::ios::binary);
+    }
+
+    uint64_t stored[2];
+    if (file.read(reinterpret_cast<char*>(stored), sizeof stored)) {
+        secret[0] = stored[0];
+        secret[1] = stored[1];
+    } else {
+        std::cerr << "Can't read the cache secret in " << directory << ", caching in memory only\n";
+        directory.clear();
+    }
+}
+
+CacheKey EncodeCache::key(const std::vector<std::vector<Pixel>>& data, const std::vector<uint64_t>& settings) {
+    SipHash128 hash(secret);
+    for (uint64_t setting : settings) {
+        hash.add(setting);
+    }
+
+    hash.add(data.size());
+    for (auto& row : data) {
+        hash.add(row.size());
+        for (auto& pixel : row) {
+            uint64_t value;
+            std::memcpy(&value, &pixel, sizeof(value));
+            hash.add(value);
+        }
+    }
+
+    return hash.finish();
+}
+
+std::string EncodeCache::path(const CacheKey& key) {
+    char name[sizeof "0123456789abcdef0123456789abcdef.idat"];
+    std::snprintf(name, sizeof name, "%016llx%016llx.idat",
+        static_cast<unsigned long long>(key.high), static_cast<unsigned long long>(key.low));
+    return directory + "/" + name;
+}
+
+// on disk an entry is its length and crc, both big endian, then the bytes
+constexpr const size_t CACHE_FILE_HEADER = 12;
+
+bool EncodeCache::find(const CacheKey& key, std::vector<uint8_t>& bytes) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto entry = index.find(key);
+        if (entry != index.end()) {
+            entries.splice(entries.begin(), entries, entry->second);
+            bytes = entry->second->second;
+            hit_count++;
+            return true;
+        }
+
+        if (directory.empty()) {
+            miss_count++;
+            return false;
+        }
+    }
+
+    // disk reads do not hold up lookups in memory
+    std::string name = path(key);
+    std::ifstream file(name, std::ios::binary);
+    if (!file) {
+        std::lock_guard<std::mutex> guard(lock);
+        miss_count++;
+        return false;
+    }
+
+    std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    bool valid = contents.size() >= CACHE_FILE_HEADER;
+    if (valid) {
+        uint64_t length = 0;
+        uint32_t crc = 0;
+        for (size_t i = 0; i < 8; i++) length = (length << 8) | contents[i];
+        for (size_t i = 8; i < 12; i++) crc = (crc << 8) | contents[i];
+
+        valid = length == contents.size() - CACHE_FILE_HEADER
+            && crc == ~crc32(contents.data() + CACHE_FILE_HEADER, length, ~0U);
+    }
+
+    if (!valid) {
+        // damaged or left over from an interrupted write
+        std::remove(name.c_str());
+        std::lock_guard<std::mutex> guard(lock);
+        miss_count++;
+        return false;
+    }
+
+    bytes.assign(contents.begin() + CACHE_FILE_HEADER, contents.end());
+
+    std::lock_guard<std::mutex> guard(lock);
+    store(key, bytes);
+    hit_count++;
+    return true;
+}
+
+void EncodeCache::insert(const CacheKey& key, const std::vector<uint8_t>& bytes) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        store(key, bytes);
+    }
+
+    if (directory.empty()) return;
+
+    uint8_t header[CACHE_FILE_HEADER];
+    uint64_t length = bytes.size();
+    uint32_t crc = ~crc32(bytes.data(), bytes.size(), ~0U);
+    for (size_t i = 0; i < 8; i++) header[i] = static_cast<uint8_t>(length >> (56 - 8 * i));
+    for (size_t i = 0; i < 4; i++) header[8 + i] = static_cast<uint8_t>(crc >> (24 - 8 * i));
+
+    // written under a unique name and renamed into place, so readers in
+    // this or another process never see a partial entry
+    std::string name = path(key);
+    std::string temporary = name + "." + std::to_string(std::random_device()()) + ".tmp";
+
+    std::ofstream file(temporary, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(header), sizeof header);
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    file.close();
+
+    if (!file || std::rename(temporary.c_str(), name.c_str()) != 0) {
+        std::remove(temporary.c_str());
+    }
+}
+
+// caller holds lock
+void EncodeCache::store(const CacheKey& key, std::vector<uint8_t> bytes) {
+    if (bytes.size() > max_bytes) return;
+
+    auto entry = index.find(key);
+    if (entry != index.end()) {
+        used_bytes -= entry->second->second.size();
+        entries.erase(entry->second);
+        index.erase(entry);
+    }
+
+    used_bytes += bytes.size();
+    entries.emplace_front(key, std::move(bytes));
+    index[key] = entries.begin();
+
+    while (used_bytes > max_bytes) {
+        used_bytes -= entries.back().second.size();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+size_t EncodeCache::hits() {
+    std::lock_guard<std::mutex> guard(lock);
+    return hit_count;
+}
+
+size_t EncodeCache::misses() {
+    std::lock_guard<std::mutex> guard(lock);
+    return miss_count;
+}
+
+size_t EncodeCache::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return used_bytes;
+}
+
 PNGImage::PNGImage() : has_error(false),use_alpha(true), IDAT_count(0), 
-    has_background(false), use_8_bit(false) {
+    has_background(false), use_8_bit(false), use_interlace(false), encode_cache(nullptr), strip_file(nullptr),
+    strip_next_row(0), strip_adler(1), strip_chunk_count(0) {
     chunks.push_back(std::make_unique<Chunks::IHDR>(0,0));
 
     chunks.push_back(std::make_unique<Chunks::sRGB>(Chunks::sRGB::intent_t::saturation));
@@ -473,7 +1311,8 @@ void PNGImage::modification_time() {
 }
 
 void PNGImage::background(Pixel color) {
-    if (has_background || has_error) {
+    // bKGD has to come before the image data, already written by begin_strips
+    if (has_background || has_error || strip_file) {
         has_error = true;
         return;
     }
@@ -483,7 +1322,7 @@ void PNGImage::background(Pixel color) {
 }
 
 void PNGImage::transparent_color(Pixel color) {
-    if (!use_alpha || has_error) {
+    if (!use_alpha || has_error || strip_file) {
         has_error = true;
         return;
     }
@@ -496,7 +1335,7 @@ void PNGImage::transparent_color(Pixel color) {
 }
 
 void PNGImage::no_alpha() {
-    if (!use_alpha || has_error) {
+    if (!use_alpha || has_error || strip_file) {
         has_error = true;
         return;
     }
@@ -508,47 +1347,622 @@ void PNGImage::no_alpha() {
 }
 
 void PNGImage::bit_depth_8() {
+    if (strip_file) {
+        has_error = true;
+        return;
+    }
+
     auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
     header->bit_depth = 8;
     use_8_bit = true;
 }
 
+void PNGImage::interlace() {
+    if (strip_file) {
+        has_error = true;
+        return;
+    }
+
+    auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
+    header->interlace_method = 1;
+    use_interlace = true;
+}
+
 void PNGImage::data(std::vector<std::vector<Pixel>> data) {
-    size_t width = data.size();
-    if (width < 1) {
+    size_t height = data.size();
+    if (height < 1 || strip_file) {
         has_error = true;
         return;
     }
 
-    size_t height = data[0].size();
-    if (height < 1) {
+    size_t width = data[0].size();
+    if (width < 1) {
         has_error = true;
         return;
     }
 
     for (auto& row : data) {
-        if (row.size() != height) {
+        if (row.size() != width) {
             has_error = true;
             return;
         }
     }
 
     auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
-    header->width = static_cast<uint16_t>(width);
-    header->height = static_cast<uint16_t>(height);
+    header->width = static_cast<uint32_t>(width);
+    header->height = static_cast<uint32_t>(height);
 
-    chunks.push_back(std::make_unique<Chunks::IDAT>(data, IDAT_count++));
+    // keep the previous IDAT, so its segments can be reused
+    for (auto& chunk : chunks) {
+        if (auto idat = dynamic_cast<Chunks::IDAT*>(chunk.get())) {
+            idat->data = std::move(data);
+            return;
+        }
+    }
+
+    chunks.push_back(std::make_unique<Chunks::IDAT>(std::move(data), IDAT_count++));
 }
 
 void PNGImage::write(std::ostream& file) {
     if (has_error) return;
 
-    chunks.push_back(std::make_unique<Chunks::IEND>());
+    meter.reset();
+
+    Chunks::IDAT* idat = nullptr;
+    for (auto& chunk : chunks) {
+        auto found = dynamic_cast<Chunks::IDAT*>(chunk.get());
+        if (found && !found->data.empty()) {
+            idat = found;
+            choose_plan(*idat);
+        }
+    }
+
+    file << "\211PNG\r\n\032\n";
+
+    for (auto& chunk : chunks) {
+        if (chunk.get() == idat && plan.stream) {
+            write_streamed(file, *idat);
+        } else {
+            chunk->write(file, *this);
+        }
+    }
+
+    Chunks::IEND().write(file, *this);
+
+    plan.peak_bytes = meter.peak();
+}
+
+void PNGImage::max_memory_bytes(size_t bytes) {
+    plan.budget = bytes;
+}
+
+// the largest plan whose worst case fits the budget, preferring to keep
+// the compressed segments for reuse, then more threads, then a longer window
+void PNGImage::choose_plan(Chunks::IDAT& idat, bool pipelined) {
+    size_t line_size = lineSize(idat.data[0].size(), *this);
+
+    // no segment, of the image or an adam7 pass, is taller than the image
+    size_t full_rows = std::min(segmentRows(idat.data, *this), idat.data.size());
+
+    // one segment needs the packed rows, the fixed huffman output, the filter
+    // scratch rows, the match tables and, for adam7, the gathered pixels
+    size_t pixel_row = use_interlace ? idat.data[0].size() * sizeof(Pixel) : 0;
+    auto work = [&](size_t segment_rows, int bits) {
+        size_t raw = line_size * segment_rows;
+        return raw + raw * 9 / 8 + 64 + 3 * line_size + matchTableSize(bits, bits) + pixel_row * segment_rows;
+    };
+
+    // segments are compressed on their own, a longer window finds nothing more
+    auto window = [&](size_t segment_rows) {
+        int bits = 8;
+        while (bits < 15 && (size_t(1) << bits) < line_size * segment_rows) bits++;
+        return bits;
+    };
+
+    size_t budget = plan.budget;
+    size_t peak = plan.peak_bytes;
+    plan = EncodePlan();
+    plan.budget = budget;
+    plan.peak_bytes = peak;
+    plan.window_bits = plan.hash_bits = window(full_rows);
+    plan.segment_rows = full_rows;
+
+    // compressed segments kept for reuse, and the stream joined from them.
+    // The pipeline keeps nothing, but has one segment more in flight than
+    // it has compress threads.
+    auto spans = segmentSpans(idat.data, full_rows, use_interlace);
+    size_t kept = 0;
+    if (!pipelined) {
+        for (auto& span : spans) kept += 2 * storedSize(spanSize(idat.data, span, *this));
+    }
+    size_t extra = pipelined ? 1 : 0;
+
+    // more threads than segments would only sit idle
+    size_t cores = std::max(1U, std::thread::hardware_concurrency());
+    for (size_t threads = std::min(cores, spans.size()); threads > 0; threads--) {
+        size_t need = kept + (threads + extra) * work(full_rows, plan.window_bits);
+        if (budget == 0 || need <= budget) {
+            plan.threads = threads;
+            plan.stream = pipelined;
+            plan.planned_bytes = need;
+            return;
+        }
+    }
+
+    // the longest match window that fits, with the tallest segments that
+    // fit alongside it.  Segments too short to use the whole window mean a
+    // shorter window would allow taller segments, so try that instead.
+    auto stream_work = [&](size_t segment_rows, int bits) {
+        return (1 + extra) * work(segment_rows, bits);
+    };
+    plan.stream = true;
+    plan.threads = 1;
+    for (int bits = 15; bits >= 8; bits--) {
+        size_t segment_rows = full_rows;
+        while (segment_rows > 1 && stream_work(segment_rows, bits) > budget) segment_rows--;
+        if (stream_work(segment_rows, bits) > budget || window(segment_rows) < bits) continue;
+
+        plan.window_bits = plan.hash_bits = bits;
+        plan.segment_rows = segment_rows;
+        plan.planned_bytes = stream_work(segment_rows, bits);
+        return;
+    }
+
+    // not even a row fits, go as small as possible and let peak_bytes show it
+    plan.window_bits = plan.hash_bits = 8;
+    plan.segment_rows = 1;
+    plan.planned_bytes = stream_work(1, 8);
+}
+
+// one IDAT chunk per segment as soon as it is compressed, nothing kept afterwards
+void PNGImage::write_streamed(std::ostream& file, Chunks::IDAT& idat) {
+    auto& data = idat.data;
+
+    // leftovers from earlier buffered writes
+    idat.segments.clear();
+    idat.segments.shrink_to_fit();
+    idat.bytes.clear();
+    idat.bytes.shrink_to_fit();
+
+    size_t tables = matchTableSize(plan.window_bits, plan.hash_bits);
+    uint32_t adler = 1;
+    bool first = true;
+
+    for (auto& span : segmentSpans(data, plan.segment_rows, use_interlace)) {
+        size_t pixels = gatheredSize(data, span);
+        meter.add(pixels);
+        auto uncompressed = packSpan(data, span, *this);
+        meter.add(uncompressed.size() + tables);
+        meter.remove(pixels);
+
+        Chunks::IDATSegment segment{};
+        segment.rows = static_cast<uint32_t>(span.count);
+        compressSegment(segment, uncompressed, plan.window_bits, plan.hash_bits);
+        size_t compressed = segment.bytes.size();
+        meter.add(compressed);
+        meter.remove(tables);
+
+        writeSegment(file, *this, idat.id, segment, first, adler);
+        first = false;
+
+        meter.remove(uncompressed.size() + compressed);
+    }
+
+    Chunks::IDAT(zlibTrailer(adler), idat.id).write(file, *this);
+}
+
+// connects pipeline stages, push blocks while the queue is full
+// and gives up, returning false, once it is closed
+template<typename T>
+class BoundedQueue {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return items.size() < capacity || closed; });
+        if (closed) return false;
+
+        items.push_back(std::move(item));
+        changed.notify_all();
+        return true;
+    }
+
+    // no more items will be pushed
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        changed.notify_all();
+    }
+
+    // false once the queue is closed and empty
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        changed.notify_all();
+        return true;
+    }
+};
+
+// segments are compressed independently, so the image data is the sum of
+// per segment sizes; compressing an even sample of segments and scaling
+// their compression ratio up to the whole image is nearly unbiased, and
+// the spread of the segments around that ratio gives the error margin.
+// Entropy alone is a poor predictor here: literals cost at least 8 bits in
+// the fixed huffman code, while long matches cost far less than the
+// entropy of the bytes.
+// filtered bytes per group of rows estimate_size samples
+constexpr const size_t ESTIMATE_GROUP_BYTES = 4 * 1024;
+
+// estimate_size samples at most 1 in this many filtered bytes of an image,
+// or the minimum, counting the rows above each group at a quarter as they
+// are only filtered and hashed
+constexpr const size_t ESTIMATE_SAMPLE_SHARE = 8;
+constexpr const size_t ESTIMATE_MIN_SAMPLE = 64 * 1024;
+
+SizeEstimate PNGImage::estimate_size(size_t sample_groups) {
+    SizeEstimate estimate{};
+    if (has_error) return estimate;
+
+    // signature, IEND and every chunk other than the image data are known exactly
+    size_t fixed = 8 + 12;
+    Chunks::IDAT* idat = nullptr;
+    for (auto& chunk : chunks) {
+        auto found = dynamic_cast<Chunks::IDAT*>(chunk.get());
+        if (found && !found->data.empty()) {
+            idat = found;
+        } else {
+            fixed += 12 + chunk->length;
+        }
+    }
+
+    estimate.bytes = fixed;
+    if (!idat) return estimate;
+
+    // sampled the way write will encode, including any memory budget
+    auto& data = idat->data;
+    choose_plan(*idat);
+    auto spans = segmentSpans(data, plan.segment_rows, use_interlace);
+    size_t segment_count = spans.size();
+    size_t window = size_t(1) << plan.window_bits;
+
+    // every segment split into groups of rows.  A group is packed along with
+    // the rows above it in its segment, up to a match window of them, which
+    // only pick its filters and prime the match window, so it compresses
+    // as it would in the middle of the segment.
+    struct Group {
+        SegmentSpan rows; // the group and the rows above it
+        size_t above;
+    };
+    std::vector<Group> groups;
+    double filtered = 0;
+    double cost = 0;
+    for (auto& span : spans) {
+        size_t line_size = spanSize(data, {span.pass, 0, 1}, *this);
+        size_t group_rows = std::max<size_t>(1, ESTIMATE_GROUP_BYTES / line_size);
+        size_t above_rows = (window + line_size - 1) / line_size;
+
+        for (size_t first = 0; first < span.count; first += group_rows) {
+            size_t above = std::min(first, above_rows);
+            size_t count = std::min(group_rows, span.count - first);
+            groups.push_back({{span.pass, span.first + first - above, above + count}, above});
+            cost += double((above / 4.0 + count) * line_size);
+        }
+        filtered += double(spanSize(data, span, *this));
+    }
+
+    // as many groups as fit the share of the image, but at least two so
+    // their spread gives a margin
+    size_t group_count = groups.size();
+    double budget = std::max(filtered / ESTIMATE_SAMPLE_SHARE, double(ESTIMATE_MIN_SAMPLE));
+    size_t affordable = static_cast<size_t>(budget / (cost / group_count));
+    size_t wanted = std::min({group_count, sample_groups, affordable});
+    wanted = std::min(group_count, std::max<size_t>(wanted, 2));
+
+    std::vector<uint32_t> order0(256);
+    std::vector<uint32_t> order1(256 * 256);
+    size_t sampled_bytes = 0;
+    std::vector<std::pair<double, double>> samples; // filtered, compressed
+
+    // one group from each of wanted strata, at a varying offset so
+    // periodic images are not always sampled at the same phase
+    for (size_t stratum = 0; stratum < wanted; stratum++) {
+        size_t begin = stratum * group_count / wanted;
+        size_t end = (stratum + 1) * group_count / wanted;
+        auto& group = groups[begin + hashMix(stratum, group_count) % (end - begin)];
+
+        auto bytes = packSpan(data, group.rows, *this);
+        size_t start = bytes.size() / group.rows.count * group.above;
+
+        uint8_t previous = 0;
+        for (size_t i = start; i < bytes.size(); i++) {
+            order0[bytes[i]]++;
+            order1[previous * 256 + bytes[i]]++;
+            previous = bytes[i];
+        }
+
+        samples.emplace_back(bytes.size() - start, deflatedBits(bytes, start, plan.window_bits, plan.hash_bits) / 8.0);
+        sampled_bytes += bytes.size() - start;
+        estimate.sampled_rows += group.rows.count - group.above;
+    }
+
+    double bits0 = 0;
+    double bits1 = 0;
+    for (size_t context = 0; context < 256; context++) {
+        if (order0[context]) {
+            bits0 -= order0[context] * std::log2(double(order0[context]) / sampled_bytes);
+        }
+
+        uint64_t total = 0;
+        for (size_t c = 0; c < 256; c++) total += order1[context * 256 + c];
+        for (size_t c = 0; c < 256; c++) {
+            uint32_t n = order1[context * 256 + c];
+            if (n) bits1 -= n * std::log2(double(n) / total);
+        }
+    }
+    estimate.order0 = bits0 / sampled_bytes;
+    estimate.order1 = bits1 / sampled_bytes;
+
+    // compressed bytes per filtered byte over the whole sample, so short
+    // groups and narrow adam7 passes count by their size
+    double sample_filtered = 0;
+    double sample_compressed = 0;
+    for (auto& sample : samples) {
+        sample_filtered += sample.first;
+        sample_compressed += sample.second;
+    }
+    double ratio = sample_compressed / sample_filtered;
+    double compressed = ratio * filtered;
+
+    // three standard errors of the ratio estimate, from how far each
+    // group is from the ratio, less as more of the image is sampled, plus
+    // a few bytes a group for matches cut off where a group starts
+    size_t sampled_groups = samples.size();
+    double squares = 0;
+    for (auto& sample : samples) {
+        double residual = sample.second - ratio * sample.first;
+        squares += residual * residual;
+    }
+    double variance = sampled_groups > 1 ? squares / (sampled_groups - 1) : 0.0;
+    double unsampled = 1.0 - double(sampled_groups) / group_count;
+    double margin = 3 * std::sqrt(variance / sampled_groups * unsampled) * group_count + 4.0 * group_count;
+
+    // zlib header and trailer, the block header, end code and flush of every
+    // segment, in one IDAT chunk, or streamed as one chunk per segment and
+    // one for the trailer
+    size_t overhead = 2 + 6 + 6 * segment_count + 12 * (plan.stream ? segment_count + 1 : 1);
+    estimate.bytes = fixed + overhead + static_cast<size_t>(compressed);
+    estimate.margin = static_cast<size_t>(margin);
+    return estimate;
+}
+
+std::future<void> PNGImage::write_async(std::ostream& file) {
+    return std::async(std::launch::async, [this, &file] {
+        if (has_error) return;
+
+        meter.reset();
+
+        Chunks::IDAT* idat = nullptr;
+        for (auto& chunk : chunks) {
+            auto found = dynamic_cast<Chunks::IDAT*>(chunk.get());
+            if (found && !found->data.empty()) {
+                idat = found;
+                choose_plan(*idat, true);
+            }
+        }
+
+        file << "\211PNG\r\n\032\n";
+
+        for (auto& chunk : chunks) {
+            if (chunk.get() == idat) {
+                write_pipelined(file, *idat);
+            } else {
+                chunk->write(file, *this);
+            }
+        }
+
+        Chunks::IEND().write(file, *this);
+
+        plan.peak_bytes = meter.peak();
+    });
+}
+
+// pack -> compress -> write.  One thread packs segments, plan.threads
+// compress them in any order and the calling thread writes them in order
+void PNGImage::write_pipelined(std::ostream& file, Chunks::IDAT& idat) {
+    auto& data = idat.data;
+    auto spans = segmentSpans(data, plan.segment_rows, use_interlace);
+    size_t tables = matchTableSize(plan.window_bits, plan.hash_bits);
+
+    // a segment takes a ticket before it is packed and returns it once
+    // written, which bounds the segments held as the plan assumed
+    size_t in_flight = plan.threads + 1;
+    BoundedQueue<size_t> tickets(in_flight);
+    BoundedQueue<std::pair<size_t, Chunks::IDATSegment>> packed(in_flight);
+    BoundedQueue<std::pair<size_t, Chunks::IDATSegment>> compressed(in_flight);
+
+    // a failing stage, or the writer, closes the queues to stop the others
+    ThreadGroup stages([&] {
+        tickets.close();
+        packed.close();
+        compressed.close();
+    });
+
+    stages.spawn([&] {
+        for (size_t n = 0; n < spans.size(); n++) {
+            if (!tickets.push(n)) return;
+
+            size_t pixels = gatheredSize(data, spans[n]);
+            meter.add(pixels);
+            Chunks::IDATSegment segment{};
+            segment.rows = static_cast<uint32_t>(spans[n].count);
+            segment.bytes = packSpan(data, spans[n], *this);
+            meter.add(segment.bytes.size());
+            meter.remove(pixels);
+
+            if (!packed.push({n, std::move(segment)})) return;
+        }
+        packed.close();
+    });
+
+    std::atomic<size_t> running(plan.threads);
+    for (size_t t = 0; t < plan.threads; t++) {
+        stages.spawn([&] {
+            std::pair<size_t, Chunks::IDATSegment> item;
+            while (packed.pop(item)) {
+                auto& segment = item.second;
+                auto uncompressed = std::move(segment.bytes);
+                meter.add(tables);
+                compressSegment(segment, uncompressed, plan.window_bits, plan.hash_bits);
+                meter.add(segment.bytes.size());
+                meter.remove(uncompressed.size() + tables);
+
+                if (!compressed.push(std::move(item))) return;
+            }
+
+            // the last worker out ends the results
+            if (--running == 0) compressed.close();
+        });
+    }
+
+    uint32_t adler = 1;
+    size_t next = 0;
+    std::map<size_t, Chunks::IDATSegment> waiting;
+    std::pair<size_t, Chunks::IDATSegment> item;
+    while (compressed.pop(item)) {
+        waiting.emplace(item.first, std::move(item.second));
+
+        for (auto found = waiting.find(next); found != waiting.end(); found = waiting.find(next)) {
+            size_t size = found->second.bytes.size();
+            writeSegment(file, *this, idat.id, found->second, next == 0, adler);
+            meter.remove(size);
+            waiting.erase(found);
+            next++;
+
+            size_t ticket;
+            tickets.pop(ticket);
+        }
+    }
+
+    // the queues also close when a stage fails, rethrow before finishing the stream
+    stages.join();
+    Chunks::IDAT(zlibTrailer(adler), idat.id).write(file, *this);
+}
+
+void PNGImage::cache(EncodeCache& cache) {
+    encode_cache = &cache;
+}
+
+bool PNGImage::begin_strips(std::ostream& file, uint32_t width, uint32_t height) {
+    std::lock_guard<std::mutex> guard(strip_lock);
+
+    // every adam7 pass needs rows from the whole image, and image data
+    // from data() would be a second zlib stream
+    bool has_data = std::any_of(chunks.begin(), chunks.end(), [](auto& chunk) {
+        return dynamic_cast<Chunks::IDAT*>(chunk.get()) != nullptr;
+    });
+    if (has_error || strip_file || use_interlace || has_data || width < 1 || height < 1) {
+        has_error = true;
+        return false;
+    }
+
+    auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
+    header->width = width;
+    header->height = height;
+
+    strip_file = &file;
+    strip_next_row = 0;
+    strip_adler = 1;
+    strip_pending.clear();
 
-    std::cout << "chunk count: " << chunks.size() << "\n";
     file << "\211PNG\r\n\032\n";
 
     for (auto& chunk : chunks) {
         chunk->write(file, *this);
     }
+    strip_chunk_count = chunks.size();
+    return true;
+}
+
+bool PNGImage::submit_strip(uint32_t row, std::vector<std::vector<Pixel>> rows) {
+    std::unique_lock<std::mutex> guard(strip_lock);
+    auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
+
+    bool valid = strip_file && !has_error && !rows.empty() && row < header->height
+        && rows.size() <= header->height - row;
+    for (auto& line : rows) {
+        valid = valid && line.size() == header->width;
+    }
+
+    if (!valid) {
+        has_error = true;
+        return false;
+    }
+    std::ostream* file = strip_file;
+
+    // filter and compress outside the lock, so producers run in parallel;
+    // the format can not change while strips are active
+    guard.unlock();
+    Chunks::IDATSegment segment{};
+    segment.rows = static_cast<uint32_t>(rows.size());
+    compressSegment(segment, packRows(rows, 0, rows.size(), *this));
+    guard.lock();
+
+    // end_strips may have finished the image meanwhile
+    if (has_error || strip_file != file) return false;
+
+    // reject strips overlapping ones already submitted
+    auto next = strip_pending.lower_bound(row);
+    bool overlaps = row < strip_next_row
+        || (next != strip_pending.end() && next->first < row + segment.rows)
+        || (next != strip_pending.begin() && std::prev(next)->first + std::prev(next)->second.rows > row);
+    if (overlaps) {
+        has_error = true;
+        return false;
+    }
+
+    strip_pending.emplace(row, std::move(segment));
+    commit_strips();
+    return true;
+}
+
+// writes every pending strip that continues the image, caller holds strip_lock
+void PNGImage::commit_strips() {
+    while (!strip_pending.empty() && strip_pending.begin()->first == strip_next_row) {
+        auto& segment = strip_pending.begin()->second;
+        writeSegment(*strip_file, *this, IDAT_count++, segment, strip_next_row == 0, strip_adler);
+        strip_next_row += segment.rows;
+        strip_pending.erase(strip_pending.begin());
+    }
+}
+
+bool PNGImage::end_strips() {
+    std::lock_guard<std::mutex> guard(strip_lock);
+
+    auto header = dynamic_cast<Chunks::IHDR*>(chunks[0].get());
+    if (has_error || !strip_file || strip_next_row != header->height) {
+        has_error = true;
+        strip_file = nullptr;
+        return false;
+    }
+
+    Chunks::IDAT(zlibTrailer(strip_adler), IDAT_count++).write(*strip_file, *this);
+
+    for (size_t i = strip_chunk_count; i < chunks.size(); i++) {
+        chunks[i]->write(*strip_file, *this);
+    }
+    Chunks::IEND().write(*strip_file, *this);
+
+    strip_file = nullptr;
+    return true;
 }
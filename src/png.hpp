@@ -5,6 +5,12 @@
 #include <memory>
 #include <string>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <future>
+#include <atomic>
 
 struct Pixel {
     uint16_t r;
@@ -26,12 +32,15 @@ struct Pixel {
 class CrcStream {
     uint32_t crc;
     std::ostream& stream;
+    bool compute;
 
 public:
-    CrcStream(std::ostream& s) : crc(0), stream(s) {}
+    // compute = false skips checksumming when the crc is already known
+    CrcStream(std::ostream& s, bool compute = true) : crc(~0U), stream(s), compute(compute) {}
 
-    CrcStream operator<<(uint8_t data);
-    CrcStream operator<<(std::string data);
+    CrcStream& operator<<(uint8_t data);
+    CrcStream& operator<<(std::string data);
+    CrcStream& write(const std::vector<uint8_t>& data);
 
     uint32_t get_crc() {
         return ~crc;
@@ -42,7 +51,7 @@ public:
 // - running on little endian machine
 // - truecolor pixels
 // - 16 bit samples
-// - not interlaced
+// - not interlaced, unless interlace() selects Adam7
 // - uses sRGB chunk (standard RGB)
 //   - implies gAMA + cHRM
 // - no iCCP chunk (advanced color management)
@@ -54,8 +63,10 @@ struct Chunk {
     uint32_t length; // max value = 2^31 - 1
     std::string type;
     uint32_t crc;
+    bool has_crc; // crc set by compute, not calculated while writing
 
     Chunk(uint32_t length, std::string type, uint32_t crc = 0);
+    virtual ~Chunk() = default;
 
     void write(std::ostream& file, struct PNGImage& image);
     virtual void write_data(CrcStream& out, struct PNGImage& image) {};
@@ -80,13 +91,30 @@ namespace Chunks {
         void write_data(CrcStream& out, struct PNGImage& image) override;
     };
 
+    // independently compressed group of rows.  An IDAT keeps its segments
+    // between encodes so unchanged rows are not compressed again; strips
+    // and the pipeline hold them until they can be written in order
+    struct IDATSegment {
+        uint64_t hash;
+        uint32_t rows;
+        size_t size; // uncompressed length, used to combine checksums
+        uint32_t adler;
+        uint32_t crc;
+        std::vector<uint8_t> bytes;
+    };
+
     struct IDAT : public Chunk {
         std::vector<std::vector<Pixel>> data;
         std::vector<uint8_t> bytes;
+        std::vector<IDATSegment> segments;
         int id;
 
         IDAT(std::vector<std::vector<Pixel>> data, int id) : Chunk(0, "IDAT"), 
-            data(data), id(id) {}
+            data(std::move(data)), id(id) {}
+
+        // already compressed part of the image's zlib stream
+        IDAT(std::vector<uint8_t> bytes, int id) : Chunk(static_cast<uint32_t>(bytes.size()), "IDAT"),
+            bytes(std::move(bytes)), id(id) {}
 
         void compute(struct PNGImage& image) override;
         void write_data(CrcStream& out, struct PNGImage& image) override;
@@ -210,6 +238,103 @@ namespace Chunks {
     };
 }
 
+// predicted result of PNGImage::write, see PNGImage::estimate_size
+struct SizeEstimate {
+    size_t bytes; // predicted file size
+    size_t margin; // the real size is expected within bytes +- margin
+    double order0; // entropy of the sampled filtered rows, bits per byte
+    double order1; // entropy given the previous byte, bits per byte
+    size_t sampled_rows;
+};
+
+// bytes held by encoder buffers, keeping the high water mark
+class MemoryMeter {
+    std::atomic<size_t> current;
+    std::atomic<size_t> high;
+
+public:
+    MemoryMeter() : current(0), high(0) {}
+
+    void add(size_t bytes);
+    void remove(size_t bytes);
+    void reset();
+
+    size_t peak() {
+        return high;
+    }
+};
+
+// how write fits its buffers into a memory budget, chosen on every write
+struct EncodePlan {
+    size_t budget; // bytes, 0 for no limit
+    int window_bits; // lz77 match distance and chain table, 2^n entries
+    int hash_bits; // match finder hash table, 2^n entries
+    size_t threads; // segments compressed at once
+    size_t segment_rows; // full width rows, about 256K of filtered bytes unless streaming
+    bool stream; // one IDAT chunk per segment, nothing kept between writes
+    size_t planned_bytes; // worst case the plan was chosen for
+    size_t peak_bytes; // measured high point of the last write
+
+    EncodePlan() : budget(0), window_bits(15), hash_bits(15), threads(1),
+        segment_rows(0), stream(false), planned_bytes(0), peak_bytes(0) {}
+};
+
+// 128 bit key of an encode cache entry
+struct CacheKey {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const CacheKey& other) const {
+        return low == other.low && high == other.high;
+    }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey& key) const {
+        return static_cast<size_t>(key.low);
+    }
+};
+
+// content addressed store of compressed image data, keyed by a siphash of the
+// pixels and encoder settings under a random secret, so whoever supplies the
+// pixels can not make two images share an entry.  If a directory is given the
+// secret is kept there in a file named secret, shared by every cache using
+// that directory; keep it unreadable to anyone supplying images.  Recently
+// used entries are kept in memory up to max_bytes; with a directory, every
+// entry is also written there and misses in memory are looked up on disk.
+// Files on disk are replaced whole and carry their length and crc; damaged
+// ones count as misses and are deleted.  Safe to share between images,
+// threads and processes.
+class EncodeCache {
+public:
+    EncodeCache(size_t max_bytes = 64 * 1024 * 1024, std::string directory = "");
+
+    CacheKey key(const std::vector<std::vector<Pixel>>& data, const std::vector<uint64_t>& settings);
+    bool find(const CacheKey& key, std::vector<uint8_t>& bytes);
+    void insert(const CacheKey& key, const std::vector<uint8_t>& bytes);
+
+    size_t hits();
+    size_t misses();
+    size_t size();
+
+private:
+    std::mutex lock;
+    size_t max_bytes;
+    size_t used_bytes;
+    std::string directory;
+    size_t hit_count;
+    size_t miss_count;
+    uint64_t secret[2];
+
+    // most recently used first
+    std::list<std::pair<CacheKey, std::vector<uint8_t>>> entries;
+    std::unordered_map<CacheKey, decltype(entries)::iterator, CacheKeyHash> index;
+
+    void load_secret();
+    void store(const CacheKey& key, std::vector<uint8_t> bytes);
+    std::string path(const CacheKey& key);
+};
+
 struct PNGImage {
     PNGImage();
     PNGImage(std::vector<std::vector<Pixel>>& data);
@@ -234,12 +359,63 @@ struct PNGImage {
 
     void bit_depth_8();
 
+    // Adam7 progressive output.  The seven passes are gathered from the
+    // image and compressed as independent segments alongside each other,
+    // then joined into one zlib stream.  Not available for strip encoding.
+    void interlace();
+
+    // data[y][x], one vector of pixels per row from the top, as for submit_strip
     void data(std::vector<std::vector<Pixel>> data);
 
     void write(std::ostream& file);
 
+    // predicts the size of write's output from up to sample_groups groups
+    // of about 4K filtered bytes spread over the image, each filtered and
+    // compressed as write would in the middle of its segment, including the
+    // plan max_memory_bytes leads to.  Samples at most an eighth of a large
+    // image.  The margin is three standard errors of the sample plus a few
+    // bytes a group for their edges.  Also reports the entropy of the
+    // filtered sample, a bound for encoders with adaptive codes.
+    SizeEstimate estimate_size(size_t sample_groups = 128);
+
+    // like write, but returns immediately.  Rows are packed, compressed by
+    // plan.threads workers and written in order by separate pipeline stages,
+    // one IDAT chunk per segment, so output starts while later rows are still
+    // being compressed.  Always streams, planned within max_memory_bytes.
+    // The image and file must outlive the returned future, which rethrows
+    // anything the stages or the stream threw.
+    std::future<void> write_async(std::ostream& file);
+
+    // reuse compressed data from previous encodes of identical pixels
+    void cache(EncodeCache& cache);
+
+    // keep write's buffers under bytes, not counting the pixels themselves.
+    // write then picks the match finder size, how many segments to compress
+    // at once, and whether to keep the compressed image or stream it out a
+    // segment at a time; see plan afterwards for the choice and peak usage.
+    // Streaming skips segment reuse and the encode cache.
+    void max_memory_bytes(size_t bytes);
+
+    // strip encoding, an alternative to data() + write()
+    // begin_strips writes all chunks added so far and the image header,
+    // then any thread may submit rows in any order.  Each strip is compressed
+    // on the submitting thread and written as soon as all rows above it are.
+    // end_strips finishes the image data and writes chunks added since begin.
+    // Fails if data() was called, and until end_strips the pixel format,
+    // data() and chunks that must precede the image data are rejected.
+    // Each returns false once the image has failed: a bad or overlapping
+    // strip, or end_strips before every row arrived.  The file is then
+    // incomplete, and later calls fail too.
+    bool begin_strips(std::ostream& file, uint32_t width, uint32_t height);
+    bool submit_strip(uint32_t row, std::vector<std::vector<Pixel>> rows);
+    bool end_strips();
+
     bool use_alpha;
     bool use_8_bit;
+    bool use_interlace;
+    EncodeCache* encode_cache;
+    EncodePlan plan;
+    MemoryMeter meter;
 
 private:
     bool has_error;
@@ -247,4 +423,16 @@ private:
     int IDAT_count;
 
     std::vector<std::unique_ptr<Chunk>> chunks;
+
+    std::ostream* strip_file;
+    std::mutex strip_lock;
+    std::map<uint32_t, Chunks::IDATSegment> strip_pending;
+    uint32_t strip_next_row;
+    uint32_t strip_adler;
+    size_t strip_chunk_count;
+
+    void commit_strips();
+    void write_pipelined(std::ostream& file, Chunks::IDAT& idat);
+    void write_streamed(std::ostream& file, Chunks::IDAT& idat);
+    void choose_plan(Chunks::IDAT& idat, bool pipelined = false);
 };